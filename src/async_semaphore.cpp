@@ -0,0 +1,294 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <ctime>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+// A semaphore for tasks running in the Asio thread pool (see
+// doc/CppConcurrency04.ThreadPoolBasedOnAsio.md).
+
+// If a task calls Semaphore::Wait() (see semaphore.cpp), it blocks the
+// worker thread, which then can't run any other task. With a count of 1 and
+// a pool of 4, three workers end up asleep.
+
+// AsyncSemaphore never blocks. AsyncAcquire() queues the rest of the task as
+// a continuation and returns at once. When enough permits are released, the
+// continuation is posted to the executor, on any worker.
+
+// The continuation receives a Permit. Like std::unique_lock, it releases
+// the permits when it is destroyed.
+
+// See:
+// https://think-async.com/Asio/asio-1.18.0/doc/asio/overview/core/basics.html
+
+class ThreadPool {
+public:
+  explicit ThreadPool(std::size_t size)
+      : work_guard_(boost::asio::make_work_guard(io_context_)) {
+    workers_.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      workers_.emplace_back(&boost::asio::io_context::run, &io_context_);
+    }
+  }
+
+  ~ThreadPool() {
+    // Let the queued work items finish.
+    work_guard_.reset();
+
+    for (auto& w : workers_) {
+      w.join();
+    }
+  }
+
+  boost::asio::io_context::executor_type executor() {
+    return io_context_.get_executor();
+  }
+
+  // Add new work item to the pool.
+  template<class F>
+  void Enqueue(F f) {
+    boost::asio::post(io_context_, f);
+  }
+
+private:
+  std::vector<std::thread> workers_;
+  boost::asio::io_context io_context_;
+
+  typedef boost::asio::io_context::executor_type ExecutorType;
+  boost::asio::executor_work_guard<ExecutorType> work_guard_;
+};
+
+class AsyncSemaphore {
+public:
+  // Owns |n| permits of a semaphore, releases them on destruction.
+  class Permit {
+  public:
+    Permit() : semaphore_(nullptr), n_(0) {
+    }
+
+    Permit(AsyncSemaphore* semaphore, int n) : semaphore_(semaphore), n_(n) {
+    }
+
+    Permit(const Permit& rhs) = delete;
+    Permit& operator=(const Permit& rhs) = delete;
+
+    Permit(Permit&& rhs) : semaphore_(rhs.semaphore_), n_(rhs.n_) {
+      rhs.semaphore_ = nullptr;
+    }
+
+    Permit& operator=(Permit&& rhs) {
+      if (this != &rhs) {
+        Release();
+        semaphore_ = rhs.semaphore_;
+        n_ = rhs.n_;
+        rhs.semaphore_ = nullptr;
+      }
+      return *this;
+    }
+
+    ~Permit() {
+      Release();
+    }
+
+    // Release before destruction, e.g., as soon as the downstream resource
+    // is done.
+    void Release() {
+      if (semaphore_ != nullptr) {
+        semaphore_->Release(n_);
+        semaphore_ = nullptr;
+      }
+    }
+
+  private:
+    AsyncSemaphore* semaphore_;
+    int n_;
+  };
+
+  typedef std::function<void(Permit)> Handler;
+
+  typedef boost::asio::io_context::executor_type ExecutorType;
+
+  AsyncSemaphore(const AsyncSemaphore& rhs) = delete;
+  AsyncSemaphore& operator=(const AsyncSemaphore& rhs) = delete;
+
+  // |count| permits in total; permits are only ever returned, so no
+  // acquisition can take more.
+  AsyncSemaphore(ExecutorType executor, int count)
+      : executor_(executor), max_count_(count), count_(count) {
+    if (count < 1) {
+      std::cerr << "AsyncSemaphore needs at least one permit." << std::endl;
+      std::terminate();
+    }
+  }
+
+  // Call |handler| on the executor once |n| permits are available.
+  // Waiters are served in FIFO order, so a big |n| is not starved by
+  // a stream of small ones. |n| must be in [1, count]: a bigger |n| would
+  // wait forever at the head of the queue, and every waiter behind it too.
+  void AsyncAcquire(int n, Handler handler) {
+    if (n < 1 || n > max_count_) {
+      std::cerr << "AsyncAcquire: " << n << " permits out of "
+                << max_count_ << "." << std::endl;
+      std::terminate();
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (!waiters_.empty() || count_ < n) {
+        waiters_.push_back(Waiter{ n, std::move(handler) });
+        return;
+      }
+      count_ -= n;
+    }
+
+    Dispatch(n, std::move(handler));
+  }
+
+  void AsyncAcquire(Handler handler) {
+    AsyncAcquire(1, std::move(handler));
+  }
+
+  // Number of continuations waiting for permits.
+  std::size_t waiting() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return waiters_.size();
+  }
+
+private:
+  struct Waiter {
+    int n;
+    Handler handler;
+  };
+
+  // The posted function object owns the permit, so if the io_context is
+  // destroyed before running it, the permit is still released.
+  struct Invoker {
+    Handler handler;
+    Permit permit;
+
+    void operator()() {
+      handler(std::move(permit));
+    }
+  };
+
+  void Release(int n) {
+    std::vector<Waiter> ready;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      count_ += n;
+
+      while (!waiters_.empty() && waiters_.front().n <= count_) {
+        count_ -= waiters_.front().n;
+        ready.push_back(std::move(waiters_.front()));
+        waiters_.pop_front();
+      }
+    }
+
+    // Post outside the lock. Never run the handler inline: we might be deep
+    // in another handler's stack, possibly holding its locks.
+    for (Waiter& waiter : ready) {
+      Dispatch(waiter.n, std::move(waiter.handler));
+    }
+  }
+
+  void Dispatch(int n, Handler handler) {
+    boost::asio::post(executor_,
+                      Invoker{ std::move(handler), Permit(this, n) });
+  }
+
+  ExecutorType executor_;
+  const int max_count_;
+  std::mutex mutex_;
+  int count_;
+  std::deque<Waiter> waiters_;
+};
+
+std::mutex g_io_mutex;
+
+std::string GetTimestamp() {
+  std::time_t t = std::time(nullptr);
+  std::tm* tm = std::localtime(&t);
+  char buf[20];
+  std::strftime(buf, sizeof(buf), "%H:%M:%S", tm);
+  return std::string(buf);
+}
+
+int main() {
+  ThreadPool pool(4);
+
+  // At most one task at a time may use the downstream resource.
+  AsyncSemaphore semaphore(pool.executor(), 1);
+
+  // The pool must not outlive the semaphore with tasks still running, so
+  // main waits for the last permit to be released.
+  std::atomic<int> remaining(3);
+  std::promise<void> done;
+
+  for (int i = 0; i < 3; ++i) {
+    pool.Enqueue([&pool, &semaphore, &remaining, &done, i] {
+      semaphore.AsyncAcquire([&pool, &remaining, &done, i](
+                                 AsyncSemaphore::Permit permit) {
+        {
+          std::lock_guard<std::mutex> lock(g_io_mutex);
+          std::cout << i << ": acquired (" << GetTimestamp() << ")"
+                    << std::endl;
+        }
+
+        // Use the resource for 1 second, e.g., an asynchronous request
+        // completed by a timer. The workers are free in the meantime.
+        // std::function needs a copyable handler, so share the permit.
+        auto shared_permit =
+            std::make_shared<AsyncSemaphore::Permit>(std::move(permit));
+        auto timer = std::make_shared<boost::asio::steady_timer>(
+            pool.executor(), std::chrono::seconds(1));
+
+        timer->async_wait([timer, shared_permit, &remaining, &done](
+                              const boost::system::error_code&) {
+          shared_permit->Release();
+          if (--remaining == 0) {
+            done.set_value();
+          }
+        });
+      });
+    });
+  }
+
+  // Meanwhile, the pool keeps running other work.
+  std::this_thread::sleep_for(std::chrono::milliseconds(500));
+  for (int i = 0; i < 4; ++i) {
+    pool.Enqueue([i] {
+      std::lock_guard<std::mutex> lock(g_io_mutex);
+      std::cout << "other work " << i << " (" << GetTimestamp() << ")"
+                << std::endl;
+    });
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(g_io_mutex);
+    std::cout << "waiting for permits: " << semaphore.waiting() << std::endl;
+  }
+
+  done.get_future().wait();
+  return 0;
+}
+
+// Output example:
+// 0: acquired (13:10:10)
+// other work 0 (13:10:10)
+// other work 1 (13:10:10)
+// other work 2 (13:10:10)
+// other work 3 (13:10:10)
+// waiting for permits: 2
+// 1: acquired (13:10:11)
+// 2: acquired (13:10:12)
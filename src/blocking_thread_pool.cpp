@@ -0,0 +1,342 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <iostream>
+#include <list>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+// A thread pool (see doc/CppConcurrency04.ThreadPoolBasedOnAsio.md) that
+// keeps running when its tasks block.
+
+// A task that calls Semaphore::Wait(), BoundedBuffer::Consume() or waits on
+// a condition variable (see cv3_timed.cpp) takes a worker out of the pool
+// for as long as it blocks. When all the workers block, the queued tasks
+// wait, even though the CPUs are idle.
+
+// A task marks the blocking call with a BlockingRegion, like Java's
+// ForkJoinPool.ManagedBlocker or Go's entersyscall. When the number of
+// workers that are not blocked drops below the pool size, the pool starts
+// a compensating worker (up to a limit). Once the blocked workers are back,
+// the extra workers retire after their current task.
+
+// A watchdog thread reports the workers that run a task for too long, both
+// the blocked ones and the ones that are not marked (a busy loop, or a
+// blocking call without a BlockingRegion).
+
+// See:
+// https://docs.oracle.com/javase/8/docs/api/java/util/concurrent/ForkJoinPool.ManagedBlocker.html
+// https://github.com/golang/go/blob/master/src/runtime/proc.go (entersyscall)
+
+typedef std::chrono::steady_clock Clock;
+
+class BlockingAwareThreadPool {
+private:
+  struct Worker;
+
+public:
+  // Mark a blocking call in a task of the pool. Does nothing on other
+  // threads.
+  class BlockingRegion {
+  public:
+    BlockingRegion(const BlockingRegion& rhs) = delete;
+    BlockingRegion& operator=(const BlockingRegion& rhs) = delete;
+
+    BlockingRegion() : worker_(current_worker_) {
+      if (worker_ != nullptr) {
+        worker_->pool->EnterBlocking(worker_);
+      }
+    }
+
+    ~BlockingRegion() {
+      if (worker_ != nullptr) {
+        worker_->pool->ExitBlocking(worker_);
+      }
+    }
+
+  private:
+    Worker* worker_;
+  };
+
+  BlockingAwareThreadPool(const BlockingAwareThreadPool& rhs) = delete;
+  BlockingAwareThreadPool& operator=(const BlockingAwareThreadPool& rhs) =
+      delete;
+
+  // |size| workers normally, up to |size + max_extra| while tasks block.
+  // A task running for longer than |stall_threshold| is reported.
+  BlockingAwareThreadPool(std::size_t size, std::size_t max_extra,
+                          Clock::duration stall_threshold)
+      : size_(size), max_extra_(max_extra), stall_threshold_(stall_threshold),
+        work_guard_(boost::asio::make_work_guard(io_context_)),
+        running_(0), blocked_(0), extra_(0), peak_running_(0),
+        stopping_(false) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    for (std::size_t i = 0; i < size; ++i) {
+      StartWorker(false);
+    }
+    watchdog_ = std::thread(&BlockingAwareThreadPool::Watchdog, this);
+  }
+
+  ~BlockingAwareThreadPool() {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      stopping_ = true;
+    }
+    watchdog_cv_.notify_one();
+    watchdog_.join();
+
+    io_context_.stop();
+
+    // No worker starts after |stopping_| is set.
+    for (Worker& w : workers_) {
+      w.thread.join();
+    }
+  }
+
+  // The most workers that ran at the same time.
+  std::size_t peak_running() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return peak_running_;
+  }
+
+  // Add new work item to the pool.
+  template<class F>
+  void Enqueue(F f) {
+    boost::asio::post(io_context_, [f] {
+      Worker* worker = current_worker_;
+      worker->task_start_ns.store(NowNs());
+      f();
+      worker->task_start_ns.store(0);
+    });
+  }
+
+private:
+  struct Worker {
+    BlockingAwareThreadPool* pool;
+    std::size_t id;
+    bool extra;
+    std::thread thread;
+    std::atomic<std::int64_t> task_start_ns;  // 0 if idle.
+    std::atomic<bool> blocking;
+    bool exited;
+  };
+
+  static std::int64_t NowNs() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        Clock::now().time_since_epoch()).count();
+  }
+
+  // Called with the mutex locked.
+  void StartWorker(bool extra) {
+    // Join the extra workers that have retired.
+    for (auto it = workers_.begin(); it != workers_.end();) {
+      if (it->exited) {
+        it->thread.join();
+        it = workers_.erase(it);
+      } else {
+        ++it;
+      }
+    }
+
+    workers_.emplace_back();
+    Worker& w = workers_.back();
+    w.pool = this;
+    w.id = next_id_++;
+    w.extra = extra;
+    w.task_start_ns.store(0);
+    w.blocking.store(false);
+    w.exited = false;
+
+    ++running_;
+    if (extra) {
+      ++extra_;
+    }
+    peak_running_ = std::max(peak_running_, running_);
+
+    w.thread = std::thread(&BlockingAwareThreadPool::WorkerLoop, this, &w);
+  }
+
+  void WorkerLoop(Worker* worker) {
+    current_worker_ = worker;
+
+    if (!worker->extra) {
+      io_context_.run();
+      return;
+    }
+
+    // An extra worker checks after each task (or every 100ms when idle)
+    // whether it is still needed.
+    while (!io_context_.stopped()) {
+      io_context_.run_one_for(std::chrono::milliseconds(100));
+
+      std::lock_guard<std::mutex> lock(mutex_);
+      if (running_ - blocked_ > size_ || stopping_) {
+        --running_;
+        --extra_;
+        worker->exited = true;
+        return;
+      }
+    }
+  }
+
+  void EnterBlocking(Worker* worker) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    worker->blocking.store(true);
+    ++blocked_;
+
+    if (running_ - blocked_ < size_ && extra_ < max_extra_ && !stopping_) {
+      StartWorker(true);
+    }
+  }
+
+  void ExitBlocking(Worker* worker) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    worker->blocking.store(false);
+    --blocked_;
+  }
+
+  void Watchdog() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    Clock::duration interval = stall_threshold_ / 2;
+
+    // See cv3_timed.cpp: stop at once, instead of at the end of a sleep.
+    while (!watchdog_cv_.wait_for(lock, interval, [this] { return stopping_; })) {
+      std::int64_t now = NowNs();
+      for (Worker& w : workers_) {
+        std::int64_t start = w.task_start_ns.load();
+        if (w.exited || start == 0) {
+          continue;
+        }
+
+        Clock::duration running = std::chrono::nanoseconds(now - start);
+        if (running >= stall_threshold_) {
+          std::cout << "watchdog: worker " << w.id << " has run a task for "
+                    << std::chrono::duration_cast<std::chrono::milliseconds>(
+                           running).count()
+                    << "ms" << (w.blocking ? " (blocked)" : " (not marked)")
+                    << std::endl;
+        }
+      }
+    }
+  }
+
+  static thread_local Worker* current_worker_;
+
+  const std::size_t size_;
+  const std::size_t max_extra_;
+  const Clock::duration stall_threshold_;
+
+  boost::asio::io_context io_context_;
+  typedef boost::asio::io_context::executor_type ExecutorType;
+  boost::asio::executor_work_guard<ExecutorType> work_guard_;
+
+  std::mutex mutex_;
+  std::list<Worker> workers_;  // std::list: a Worker never moves.
+  std::size_t next_id_ = 0;
+  std::size_t running_;
+  std::size_t blocked_;
+  std::size_t extra_;
+  std::size_t peak_running_;
+  bool stopping_;
+
+  std::thread watchdog_;
+  std::condition_variable watchdog_cv_;
+};
+
+thread_local BlockingAwareThreadPool::Worker*
+    BlockingAwareThreadPool::current_worker_ = nullptr;
+
+// Burn some CPU to simulate work.
+void Spin(std::chrono::milliseconds duration) {
+  Clock::time_point end = Clock::now() + duration;
+  while (Clock::now() < end) {
+  }
+}
+
+// 8 tasks that block for 200ms each, then 40 CPU tasks of 5ms each.
+// Return how long it takes until the CPU tasks are done.
+double Run(bool mark_blocking) {
+  const int kBlockingTasks = 8;
+  const int kCpuTasks = 40;
+
+  std::mutex mutex;
+  std::condition_variable cv;
+  int cpu_remaining = kCpuTasks;
+
+  Clock::time_point start = Clock::now();
+  double ms = 0;
+  {
+    BlockingAwareThreadPool pool(4, 8, std::chrono::milliseconds(150));
+
+    for (int i = 0; i < kBlockingTasks; ++i) {
+      pool.Enqueue([mark_blocking] {
+        std::mutex m;
+        std::condition_variable c;
+        std::unique_lock<std::mutex> lock(m);
+
+        // E.g., waiting for a reply (see cv3_timed.cpp).
+        if (mark_blocking) {
+          BlockingAwareThreadPool::BlockingRegion region;
+          c.wait_for(lock, std::chrono::milliseconds(200));
+        } else {
+          c.wait_for(lock, std::chrono::milliseconds(200));
+        }
+      });
+    }
+
+    for (int i = 0; i < kCpuTasks; ++i) {
+      pool.Enqueue([&] {
+        Spin(std::chrono::milliseconds(5));
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (--cpu_remaining == 0) {
+          cv.notify_one();
+        }
+      });
+    }
+
+    {
+      std::unique_lock<std::mutex> lock(mutex);
+      cv.wait(lock, [&cpu_remaining] { return cpu_remaining == 0; });
+    }
+    ms = std::chrono::duration<double, std::milli>(Clock::now() - start)
+             .count();
+
+    std::cout << "  peak workers: " << pool.peak_running() << std::endl;
+  }
+
+  return ms;
+}
+
+int main() {
+  std::cout << "Blocking calls not marked:" << std::endl;
+  double unmarked = Run(false);
+  std::cout << "  CPU tasks done in " << unmarked << "ms" << std::endl;
+
+  std::cout << "Blocking calls in a BlockingRegion:" << std::endl;
+  double marked = Run(true);
+  std::cout << "  CPU tasks done in " << marked << "ms" << std::endl;
+
+  return 0;
+}
+
+// Output example (1 core):
+// Blocking calls not marked:
+// watchdog: worker 0 has run a task for 150ms (not marked)
+// watchdog: worker 1 has run a task for 150ms (not marked)
+// watchdog: worker 2 has run a task for 150ms (not marked)
+// watchdog: worker 3 has run a task for 150ms (not marked)
+// watchdog: worker 0 has run a task for 179ms (not marked)
+// ...
+//   peak workers: 4
+//   CPU tasks done in 557.978ms
+// Blocking calls in a BlockingRegion:
+//   peak workers: 12
+//   CPU tasks done in 151.589ms
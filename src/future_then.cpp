@@ -0,0 +1,348 @@
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <memory>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+// Futures with continuations: Then(), WhenAll() and WhenAny().
+
+// cv1.cpp and cv2.cpp make the main thread sleep on a condition variable
+// until the worker is done; std::future::get() does the same. Inside a
+// thread pool that wastes a worker for each pending result. Here instead,
+// the consumer of a result attaches a continuation, which is posted to the
+// pool when the value arrives. Nobody waits.
+
+// The shared state of a future is lock-free: a value slot, a continuation
+// slot, and one atomic word with two bits, "has value" and "has
+// continuation". The producer fills the value slot and sets its bit; the
+// consumer fills the continuation slot and sets its bit. Whoever sets the
+// second bit (fetch_or returns the other bit already set) runs the
+// continuation. Each slot is written once, before its bit is published, so
+// there is no race on the slots. A third bit claims the continuation slot,
+// so a second Then() is caught instead of racing with the first.
+
+// Error handling (exceptions) is left out to keep the example small.
+
+// See:
+// http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2013/n3721.pdf
+// https://www.boost.org/doc/libs/1_74_0/doc/html/thread/synchronization.html#thread.synchronization.futures.then
+
+class ThreadPool {
+public:
+  explicit ThreadPool(std::size_t size)
+      : work_guard_(boost::asio::make_work_guard(io_context_)) {
+    workers_.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      workers_.emplace_back(&boost::asio::io_context::run, &io_context_);
+    }
+  }
+
+  ~ThreadPool() {
+    io_context_.stop();
+
+    for (auto& w : workers_) {
+      w.join();
+    }
+  }
+
+  // Add new work item to the pool.
+  template<class F>
+  void Enqueue(F f) {
+    boost::asio::post(io_context_, f);
+  }
+
+private:
+  std::vector<std::thread> workers_;
+  boost::asio::io_context io_context_;
+
+  typedef boost::asio::io_context::executor_type ExecutorType;
+  boost::asio::executor_work_guard<ExecutorType> work_guard_;
+};
+
+template <typename T>
+class SharedState {
+public:
+  SharedState(const SharedState& rhs) = delete;
+  SharedState& operator=(const SharedState& rhs) = delete;
+
+  SharedState() : state_(0) {
+  }
+
+  // Called once, by the producer.
+  void SetValue(T value) {
+    value_ = std::move(value);
+    if (state_.fetch_or(kHasValue, std::memory_order_acq_rel) &
+        kHasContinuation) {
+      Fire();
+    }
+  }
+
+  // Called once, by the consumer. |continuation| runs inline on the thread
+  // that completes the state; keep it short (e.g., post something).
+  void SetContinuation(std::function<void(const T&)> continuation) {
+    // Claim the slot first: a second continuation must not overwrite the
+    // first one, which may be running already.
+    if (state_.fetch_or(kClaimed, std::memory_order_relaxed) & kClaimed) {
+      std::cerr << "A future takes only one continuation." << std::endl;
+      std::terminate();
+    }
+
+    continuation_ = std::move(continuation);
+    if (state_.fetch_or(kHasContinuation, std::memory_order_acq_rel) &
+        kHasValue) {
+      Fire();
+    }
+  }
+
+private:
+  static const unsigned kHasValue = 1;
+  static const unsigned kHasContinuation = 2;
+  static const unsigned kClaimed = 4;  // The continuation slot is taken.
+
+  void Fire() {
+    continuation_(value_);
+    continuation_ = nullptr;  // Release what it captured.
+  }
+
+  std::atomic<unsigned> state_;
+  T value_;
+  std::function<void(const T&)> continuation_;
+};
+
+template <typename T>
+class Future;
+
+template <typename T>
+class Promise {
+public:
+  Promise() : state_(std::make_shared<SharedState<T>>()) {
+  }
+
+  Future<T> GetFuture() const {
+    return Future<T>(state_);
+  }
+
+  void SetValue(T value) const {
+    state_->SetValue(std::move(value));
+  }
+
+private:
+  std::shared_ptr<SharedState<T>> state_;
+};
+
+// A future takes one continuation: either Then() or OnReady(), once.
+template <typename T>
+class Future {
+public:
+  explicit Future(std::shared_ptr<SharedState<T>> state) : state_(state) {
+  }
+
+  // Run |f(value)| on the pool once the value is ready, and return a future
+  // of its result.
+  template <typename F>
+  Future<typename std::result_of<F(T)>::type> Then(ThreadPool& pool, F f) {
+    typedef typename std::result_of<F(T)>::type R;
+
+    Promise<R> promise;
+    Future<R> future = promise.GetFuture();
+
+    ThreadPool* p = &pool;
+    state_->SetContinuation([p, promise, f](const T& value) {
+      p->Enqueue([promise, f, value] { promise.SetValue(f(value)); });
+    });
+
+    return future;
+  }
+
+  // Call |f(value)| inline on the completing thread. For combinators only.
+  void OnReady(std::function<void(const T&)> f) {
+    state_->SetContinuation(std::move(f));
+  }
+
+private:
+  std::shared_ptr<SharedState<T>> state_;
+};
+
+template <typename T>
+Future<T> MakeReadyFuture(T value) {
+  Promise<T> promise;
+  promise.SetValue(std::move(value));
+  return promise.GetFuture();
+}
+
+// Run |f()| on the pool.
+template <typename F>
+Future<typename std::result_of<F()>::type> Async(ThreadPool& pool, F f) {
+  typedef typename std::result_of<F()>::type R;
+
+  Promise<R> promise;
+  pool.Enqueue([promise, f] { promise.SetValue(f()); });
+  return promise.GetFuture();
+}
+
+// A future of all the values, in order.
+template <typename T>
+Future<std::vector<T>> WhenAll(std::vector<Future<T>>& futures) {
+  if (futures.empty()) {
+    return MakeReadyFuture(std::vector<T>());
+  }
+
+  struct Context {
+    std::vector<T> values;
+    std::atomic<std::size_t> remaining;
+    Promise<std::vector<T>> promise;
+  };
+
+  auto context = std::make_shared<Context>();
+  context->values.resize(futures.size());
+  context->remaining.store(futures.size());
+
+  for (std::size_t i = 0; i < futures.size(); ++i) {
+    futures[i].OnReady([context, i](const T& value) {
+      context->values[i] = value;
+      // The last one completes the result. acq_rel: it sees all the values
+      // stored by the others.
+      if (context->remaining.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+        context->promise.SetValue(std::move(context->values));
+      }
+    });
+  }
+
+  return context->promise.GetFuture();
+}
+
+// A future of the first value, and its index. |futures| must not be empty:
+// there would be no first value, ever.
+template <typename T>
+Future<std::pair<std::size_t, T>> WhenAny(std::vector<Future<T>>& futures) {
+  if (futures.empty()) {
+    std::cerr << "WhenAny of no futures never completes." << std::endl;
+    std::terminate();
+  }
+
+  struct Context {
+    std::atomic<bool> done;
+    Promise<std::pair<std::size_t, T>> promise;
+  };
+
+  auto context = std::make_shared<Context>();
+  context->done.store(false);
+
+  for (std::size_t i = 0; i < futures.size(); ++i) {
+    futures[i].OnReady([context, i](const T& value) {
+      if (!context->done.exchange(true)) {
+        context->promise.SetValue(std::make_pair(i, value));
+      }
+    });
+  }
+
+  return context->promise.GetFuture();
+}
+
+// Burn some CPU to simulate work.
+std::int64_t Work(std::int64_t n, int rounds = 100) {
+  std::int64_t x = n;
+  for (int i = 0; i < rounds; ++i) {
+    x = (x * 31 + 7) % 1000003;
+  }
+  return x;
+}
+
+int main() {
+  ThreadPool pool(4);
+
+  // Fan out 100000 tasks, fan in by groups of 100, then fan in the groups.
+  // No task ever waits for another; each stage is a continuation.
+  const std::size_t kGroups = 1000;
+  const std::size_t kGroupSize = 100;
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<Future<std::int64_t>> group_sums;
+  group_sums.reserve(kGroups);
+
+  for (std::size_t g = 0; g < kGroups; ++g) {
+    std::vector<Future<std::int64_t>> tasks;
+    tasks.reserve(kGroupSize);
+    for (std::size_t i = 0; i < kGroupSize; ++i) {
+      std::int64_t n = static_cast<std::int64_t>(g * kGroupSize + i);
+      tasks.push_back(Async(pool, [n] { return Work(n); }));
+    }
+
+    group_sums.push_back(WhenAll(tasks).Then(
+        pool, [](const std::vector<std::int64_t>& values) {
+          std::int64_t sum = 0;
+          for (std::int64_t v : values) {
+            sum += v;
+          }
+          return sum;
+        }));
+  }
+
+  Future<std::int64_t> total = WhenAll(group_sums).Then(
+      pool, [](const std::vector<std::int64_t>& sums) {
+        std::int64_t sum = 0;
+        for (std::int64_t s : sums) {
+          sum += s;
+        }
+        return sum;
+      });
+
+  // Only main (not a pool worker) waits, once, for the final result.
+  std::promise<std::int64_t> done;
+  total.OnReady([&done](const std::int64_t& value) { done.set_value(value); });
+  std::int64_t result = done.get_future().get();
+
+  double ms = std::chrono::duration<double, std::milli>(
+      std::chrono::steady_clock::now() - start).count();
+
+  std::int64_t expected = 0;
+  for (std::int64_t n = 0; n < 100000; ++n) {
+    expected += Work(n);
+  }
+
+  std::cout << "100000 tasks in " << ms << "ms, total=" << result
+            << (result == expected ? " (ok)" : " (WRONG)") << std::endl;
+
+  // WhenAny: the first of three results. The last racer has the least
+  // work to do.
+  std::atomic<int> running(3);
+  std::promise<void> all_done;
+
+  std::vector<Future<std::int64_t>> racers;
+  for (int i = 0; i < 3; ++i) {
+    racers.push_back(Async(pool, [i, &running, &all_done] {
+      std::int64_t value = Work(i, 10000000 * (3 - i));
+      if (--running == 0) {
+        all_done.set_value();
+      }
+      return value;
+    }));
+  }
+
+  std::promise<std::pair<std::size_t, std::int64_t>> first;
+  WhenAny(racers).OnReady(
+      [&first](const std::pair<std::size_t, std::int64_t>& p) {
+        first.set_value(p);
+      });
+  std::cout << "first: #" << first.get_future().get().first << std::endl;
+
+  // Let the slower racers finish before the pool is stopped.
+  all_done.get_future().wait();
+
+  return 0;
+}
+
+// Output example:
+// 100000 tasks in 175.679ms, total=49998617625 (ok)
+// first: #2
@@ -0,0 +1,536 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <exception>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Hazard pointers: safe memory reclamation for lock-free data structures.
+
+// In a lock-free stack, thread A reads the top node and is about to read
+// its |next|, while thread B pops the same node and deletes it. A then reads
+// freed memory. With a mutex the question never comes up; without one,
+// someone must tell when no thread can still be reading a removed node.
+
+// Before dereferencing a shared node, a reader publishes its address in one
+// of its hazard slots (and re-checks that the node is still reachable).
+// A thread that removes a node doesn't delete it, but retires it to its own
+// list. Once the list is long enough, the thread scans all the hazard slots
+// and deletes the retired nodes that nobody protects.
+
+// - Protecting a node is an atomic store and a re-load, no lock, no
+//   counter shared by all readers.
+// - A scan is O(R + H log H) for R retired nodes and H hazard slots, and
+//   runs every R = max(64, 2H) retirements, so the amortized cost per node
+//   is constant.
+// - A stalled thread protects at most its own slots. The number of retired
+//   but not reclaimed nodes stays bounded by about R + H per thread.
+
+// See:
+// Maged M. Michael, "Hazard Pointers: Safe Memory Reclamation for Lock-Free
+// Objects", IEEE TPDS 2004.
+// http://www.open-std.org/jtc1/sc22/wg21/docs/papers/2016/p0233r0.pdf
+
+const std::size_t kSlotsPerThread = 2;
+
+// The hazard slots of one thread. Records are never freed (until the domain
+// is destroyed), only released and reused by another thread.
+struct HazardRecord {
+  std::atomic<bool> active;
+  std::atomic<void*> slots[kSlotsPerThread];
+  std::atomic<std::size_t> retired_count;  // Written by the owner only.
+  HazardRecord* next;
+
+  // C++11 new ignores alignas(64), so pad instead: the slots of two records
+  // are at least a cache line apart and don't share one.
+  char padding[64];
+};
+
+class HazardDomain {
+public:
+  HazardDomain(const HazardDomain& rhs) = delete;
+  HazardDomain& operator=(const HazardDomain& rhs) = delete;
+
+  ~HazardDomain() {
+    // No thread uses the domain any more.
+    for (Retired& r : orphans_) {
+      r.deleter(r.ptr);
+    }
+
+    HazardRecord* record = records_.load();
+    while (record != nullptr) {
+      HazardRecord* next = record->next;
+      delete record;
+      record = next;
+    }
+  }
+
+  // The one domain. There are no others: the thread data below is one
+  // thread_local per thread, not one per domain.
+  static HazardDomain& Default() {
+    static HazardDomain domain;
+    return domain;
+  }
+
+  // Number of retired nodes not deleted yet. Sums up the per-thread counts,
+  // so it is meant for monitoring, not for every operation.
+  std::size_t unreclaimed() const {
+    std::size_t count = 0;
+    for (HazardRecord* r = records_.load(); r != nullptr; r = r->next) {
+      count += r->retired_count.load(std::memory_order_relaxed);
+    }
+
+    std::lock_guard<std::mutex> lock(orphans_mutex_);
+    return count + orphans_.size();
+  }
+
+  std::atomic<void*>& AcquireSlot() {
+    ThreadData& data = GetThreadData();
+    for (std::size_t i = 0; i < kSlotsPerThread; ++i) {
+      if ((data.used & (1u << i)) == 0) {
+        data.used |= (1u << i);
+        return data.record->slots[i];
+      }
+    }
+
+    std::cerr << "Too many hazard pointers in one thread." << std::endl;
+    std::terminate();
+  }
+
+  void ReleaseSlot(std::atomic<void*>& slot) {
+    ThreadData& data = GetThreadData();
+    slot.store(nullptr, std::memory_order_release);
+    data.used &= ~(1u << (&slot - data.record->slots));
+  }
+
+  // Delete |ptr| once no hazard pointer protects it.
+  template <typename T>
+  void Retire(T* ptr) {
+    ThreadData& data = GetThreadData();
+    data.retired.push_back(Retired{ ptr, &Delete<T> });
+
+    std::size_t threshold =
+        std::max<std::size_t>(64, 2 * kSlotsPerThread * record_count_);
+    if (data.retired.size() >= threshold) {
+      Scan(&data.retired);
+    }
+    data.record->retired_count.store(data.retired.size(),
+                                     std::memory_order_relaxed);
+  }
+
+private:
+  HazardDomain() : records_(nullptr), record_count_(0) {
+  }
+
+  struct Retired {
+    void* ptr;
+    void (*deleter)(void*);
+  };
+
+  // Per-thread state, released back to the domain when the thread exits.
+  struct ThreadData {
+    HazardDomain* domain;
+    HazardRecord* record;
+    unsigned used;  // Bit mask of the slots in use.
+    std::vector<Retired> retired;
+
+    explicit ThreadData(HazardDomain* d)
+        : domain(d), record(d->AcquireRecord()), used(0) {
+    }
+
+    ~ThreadData() {
+      domain->Scan(&retired);
+
+      // Nodes still protected by others are adopted by the next scan of
+      // any thread.
+      if (!retired.empty()) {
+        std::lock_guard<std::mutex> lock(domain->orphans_mutex_);
+        domain->orphans_.insert(domain->orphans_.end(), retired.begin(),
+                                retired.end());
+      }
+
+      domain->ReleaseRecord(record);
+    }
+  };
+
+  template <typename T>
+  static void Delete(void* ptr) {
+    delete static_cast<T*>(ptr);
+  }
+
+  // Correct because Default() is the only domain.
+  ThreadData& GetThreadData() {
+    static thread_local ThreadData data(this);
+    return data;
+  }
+
+  HazardRecord* AcquireRecord() {
+    // Reuse a record released by an exited thread.
+    for (HazardRecord* r = records_.load(); r != nullptr; r = r->next) {
+      bool expected = false;
+      if (!r->active.load(std::memory_order_relaxed) &&
+          r->active.compare_exchange_strong(expected, true)) {
+        return r;
+      }
+    }
+
+    HazardRecord* record = new HazardRecord;
+    record->active.store(true);
+    for (std::size_t i = 0; i < kSlotsPerThread; ++i) {
+      record->slots[i].store(nullptr);
+    }
+    record->retired_count.store(0);
+
+    record->next = records_.load();
+    while (!records_.compare_exchange_weak(record->next, record)) {
+    }
+    ++record_count_;
+    return record;
+  }
+
+  void ReleaseRecord(HazardRecord* record) {
+    for (std::size_t i = 0; i < kSlotsPerThread; ++i) {
+      record->slots[i].store(nullptr, std::memory_order_release);
+    }
+    record->retired_count.store(0, std::memory_order_relaxed);
+    record->active.store(false, std::memory_order_release);
+  }
+
+  void Scan(std::vector<Retired>* retired) {
+    // Adopt the nodes left by exited threads, if any.
+    {
+      std::unique_lock<std::mutex> lock(orphans_mutex_, std::try_to_lock);
+      if (lock.owns_lock() && !orphans_.empty()) {
+        retired->insert(retired->end(), orphans_.begin(), orphans_.end());
+        orphans_.clear();
+      }
+    }
+
+    // Pairs with the seq_cst store in HazardPointer::Protect(): a reader
+    // either sees the node unlinked (and retries), or we see its hazard.
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+
+    std::vector<void*> hazards;
+    hazards.reserve(record_count_ * kSlotsPerThread);
+    for (HazardRecord* r = records_.load(); r != nullptr; r = r->next) {
+      for (std::size_t i = 0; i < kSlotsPerThread; ++i) {
+        void* p = r->slots[i].load(std::memory_order_acquire);
+        if (p != nullptr) {
+          hazards.push_back(p);
+        }
+      }
+    }
+    std::sort(hazards.begin(), hazards.end());
+
+    std::size_t kept = 0;
+    for (Retired& r : *retired) {
+      if (std::binary_search(hazards.begin(), hazards.end(), r.ptr)) {
+        (*retired)[kept++] = r;
+      } else {
+        r.deleter(r.ptr);
+      }
+    }
+    retired->resize(kept);
+  }
+
+  std::atomic<HazardRecord*> records_;
+  std::atomic<std::size_t> record_count_;
+
+  mutable std::mutex orphans_mutex_;
+  std::vector<Retired> orphans_;
+};
+
+// Owns one hazard slot of the calling thread.
+class HazardPointer {
+public:
+  HazardPointer(const HazardPointer& rhs) = delete;
+  HazardPointer& operator=(const HazardPointer& rhs) = delete;
+
+  HazardPointer() : slot_(HazardDomain::Default().AcquireSlot()) {
+  }
+
+  ~HazardPointer() {
+    HazardDomain::Default().ReleaseSlot(slot_);
+  }
+
+  // Load |src| and protect the result, so that it can be dereferenced until
+  // the next Protect() or Reset().
+  template <typename T>
+  T* Protect(const std::atomic<T*>& src) {
+    T* p = src.load(std::memory_order_relaxed);
+    while (true) {
+      slot_.store(p, std::memory_order_seq_cst);
+      // seq_cst, not acquire: an acquire load may be reordered before the
+      // store above, and then Scan() could miss a hazard we validated.
+      T* q = src.load(std::memory_order_seq_cst);
+      if (p == q) {
+        return p;  // Still reachable after the hazard is visible.
+      }
+      p = q;
+    }
+  }
+
+  // Protect a pointer that the caller validates itself, with a seq_cst
+  // load after Set() (see Protect()).
+  void Set(void* p) {
+    slot_.store(p, std::memory_order_seq_cst);
+  }
+
+  void Reset() {
+    slot_.store(nullptr, std::memory_order_release);
+  }
+
+private:
+  std::atomic<void*>& slot_;
+};
+
+template <typename T>
+void Retire(T* ptr) {
+  HazardDomain::Default().Retire(ptr);
+}
+
+// Treiber's lock-free stack.
+template <typename T>
+class LockFreeStack {
+public:
+  LockFreeStack(const LockFreeStack& rhs) = delete;
+  LockFreeStack& operator=(const LockFreeStack& rhs) = delete;
+
+  LockFreeStack() : head_(nullptr) {
+  }
+
+  ~LockFreeStack() {
+    Node* node = head_.load();
+    while (node != nullptr) {
+      Node* next = node->next;
+      delete node;
+      node = next;
+    }
+  }
+
+  void Push(T value) {
+    Node* node = new Node{ std::move(value), head_.load() };
+    while (!head_.compare_exchange_weak(node->next, node)) {
+    }
+  }
+
+  bool Pop(T* value) {
+    HazardPointer hp;
+    Node* head = nullptr;
+    while (true) {
+      head = hp.Protect(head_);
+      if (head == nullptr) {
+        return false;
+      }
+      // Safe to read |head->next|: |head| can't be deleted meanwhile.
+      if (head_.compare_exchange_weak(head, head->next)) {
+        break;
+      }
+    }
+
+    hp.Reset();
+    *value = std::move(head->value);
+    Retire(head);
+    return true;
+  }
+
+private:
+  struct Node {
+    T value;
+    Node* next;
+  };
+
+  std::atomic<Node*> head_;
+};
+
+// Michael and Scott's lock-free queue.
+template <typename T>
+class LockFreeQueue {
+public:
+  LockFreeQueue(const LockFreeQueue& rhs) = delete;
+  LockFreeQueue& operator=(const LockFreeQueue& rhs) = delete;
+
+  LockFreeQueue() {
+    Node* dummy = new Node;
+    head_.store(dummy);
+    tail_.store(dummy);
+  }
+
+  ~LockFreeQueue() {
+    Node* node = head_.load();
+    while (node != nullptr) {
+      Node* next = node->next.load();
+      delete node;
+      node = next;
+    }
+  }
+
+  void Push(T value) {
+    Node* node = new Node;
+    node->value = std::move(value);
+
+    HazardPointer hp;
+    while (true) {
+      Node* tail = hp.Protect(tail_);
+      Node* next = tail->next.load();
+      if (next != nullptr) {
+        // Help a slow enqueuer to swing the tail.
+        tail_.compare_exchange_weak(tail, next);
+        continue;
+      }
+
+      if (tail->next.compare_exchange_weak(next, node)) {
+        tail_.compare_exchange_strong(tail, node);
+        return;
+      }
+    }
+  }
+
+  bool Pop(T* value) {
+    HazardPointer hp_head;
+    HazardPointer hp_next;
+    while (true) {
+      Node* head = hp_head.Protect(head_);
+      Node* next = head->next.load();
+
+      // |next| is protected only if |head| is still the head after the
+      // hazard is set: a node is retired only after it left the head.
+      hp_next.Set(next);
+      if (head_.load() != head) {
+        continue;
+      }
+
+      if (next == nullptr) {
+        return false;
+      }
+
+      Node* tail = tail_.load();
+      if (head == tail) {
+        tail_.compare_exchange_weak(tail, next);
+        continue;
+      }
+
+      if (head_.compare_exchange_weak(head, next)) {
+        // |next| becomes the new dummy, its value is ours.
+        *value = std::move(next->value);
+        hp_head.Reset();
+        hp_next.Reset();
+        Retire(head);
+        return true;
+      }
+    }
+  }
+
+private:
+  struct Node {
+    T value;
+    std::atomic<Node*> next;
+
+    Node() : value(), next(nullptr) {
+    }
+  };
+
+  std::atomic<Node*> head_;
+  std::atomic<Node*> tail_;
+};
+
+// Stress test: |kThreads| threads each push their own range of values and
+// pop as many values. Every value must be popped exactly once.
+template <typename Container>
+bool StressTest(const char* name, bool stall) {
+  const int kThreads = 4;
+  const int kPerThread = 100000;
+
+  Container container;
+  std::vector<std::atomic<int>> popped(kThreads * kPerThread);
+  for (auto& p : popped) {
+    p.store(0);
+  }
+
+  std::atomic<bool> stop(false);
+  std::atomic<std::size_t> max_unreclaimed(0);
+
+  // A stalled reader: holds a hazard pointer for the whole test. It pins
+  // the one node it protects, and nothing else.
+  std::thread staller;
+  if (stall) {
+    staller = std::thread([&stop] {
+      HazardPointer hp;
+      int* node = new int(0);
+      hp.Set(node);
+      Retire(node);
+      while (!stop) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+      }
+    });
+  }
+
+  auto start = std::chrono::steady_clock::now();
+
+  std::vector<std::thread> threads;
+  for (int t = 0; t < kThreads; ++t) {
+    threads.emplace_back([&, t] {
+      for (int i = 0; i < kPerThread; ++i) {
+        container.Push(t * kPerThread + i);
+
+        int value;
+        while (!container.Pop(&value)) {
+        }
+        ++popped[value];
+
+        // Sample now and then; unreclaimed() walks all the records.
+        if (i % 256 == 0) {
+          std::size_t unreclaimed = HazardDomain::Default().unreclaimed();
+          std::size_t max = max_unreclaimed.load();
+          while (unreclaimed > max &&
+                 !max_unreclaimed.compare_exchange_weak(max, unreclaimed)) {
+          }
+        }
+      }
+    });
+  }
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  double seconds = std::chrono::duration<double>(
+      std::chrono::steady_clock::now() - start).count();
+
+  stop = true;
+  if (staller.joinable()) {
+    staller.join();
+  }
+
+  bool ok = true;
+  for (auto& p : popped) {
+    if (p != 1) {
+      ok = false;
+    }
+  }
+
+  std::cout << name << (stall ? " (with a stalled thread)" : "") << ": "
+            << static_cast<int>(2 * kThreads * kPerThread / seconds)
+            << " ops/s, max unreclaimed nodes=" << max_unreclaimed
+            << (ok ? ", ok" : ", FAILED") << std::endl;
+  return ok;
+}
+
+int main() {
+  bool ok = true;
+  ok = StressTest<LockFreeStack<int>>("stack", false) && ok;
+  ok = StressTest<LockFreeStack<int>>("stack", true) && ok;
+  ok = StressTest<LockFreeQueue<int>>("queue", false) && ok;
+  ok = StressTest<LockFreeQueue<int>>("queue", true) && ok;
+  return ok ? 0 : 1;
+}
+
+// Output example (1 core):
+// stack: 23932795 ops/s, max unreclaimed nodes=149, ok
+// stack (with a stalled thread): 24100863 ops/s, max unreclaimed nodes=205, ok
+// queue: 20114500 ops/s, max unreclaimed nodes=196, ok
+// queue (with a stalled thread): 20470992 ops/s, max unreclaimed nodes=229, ok
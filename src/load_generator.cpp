@@ -0,0 +1,417 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// A load generator for the producer/consumer bounded buffer.
+// Use it to choose the buffer capacity and the number of threads.
+
+// Usage:
+//   load_generator [--producers=N] [--consumers=N] [--capacity=N]
+//                  [--payload=BYTES] [--rate=ITEMS_PER_SECOND]
+//                  [--duration=SECONDS]
+// E.g.,
+//   load_generator --producers=2 --consumers=4 --capacity=64 --rate=200000
+
+// With --rate=0 (the default) the producers run closed-loop, as fast as the
+// buffer accepts items. With a rate, they run open-loop: item i of producer
+// k (of P) is due at start + (i * P + k) / rate, whether or not the buffer
+// is keeping up. The producers take turns, one item every 1 / rate. Latency is measured from the due time, not from the time the item
+// was actually produced, so a stalled producer doesn't hide the stall
+// (coordinated omission).
+
+// The result is printed as JSON.
+
+// See:
+// http://hdrhistogram.org/
+// https://www.scylladb.com/2021/04/22/on-coordinated-omission/
+
+typedef std::chrono::steady_clock Clock;
+
+struct Options {
+  int producers = 1;
+  int consumers = 3;
+  std::size_t capacity = 2;
+  std::size_t payload = 64;
+  double rate = 0;  // Items per second, all producers together.
+  double duration = 5;  // Seconds.
+};
+
+// Log-linear histogram of nanosecond values, like HdrHistogram: every power
+// of 2 is split into 64 linear sub-buckets, so a recorded value is off by
+// less than 1/64 (about 1.6%) whatever its magnitude.
+class Histogram {
+public:
+  Histogram() : counts_(kBucketCount, 0), total_(0), max_(0) {
+  }
+
+  void Record(std::uint64_t value) {
+    ++counts_[Index(value)];
+    ++total_;
+    if (value > max_) {
+      max_ = value;
+    }
+  }
+
+  void Merge(const Histogram& other) {
+    for (std::size_t i = 0; i < kBucketCount; ++i) {
+      counts_[i] += other.counts_[i];
+    }
+    total_ += other.total_;
+    if (other.max_ > max_) {
+      max_ = other.max_;
+    }
+  }
+
+  std::uint64_t total() const {
+    return total_;
+  }
+
+  std::uint64_t max() const {
+    return max_;
+  }
+
+  // E.g., Percentile(99.9).
+  std::uint64_t Percentile(double percentile) const {
+    std::uint64_t rank =
+        static_cast<std::uint64_t>(percentile / 100 * total_ + 0.5);
+    if (rank == 0) {
+      rank = 1;
+    }
+
+    std::uint64_t count = 0;
+    for (std::size_t i = 0; i < kBucketCount; ++i) {
+      count += counts_[i];
+      if (count >= rank) {
+        std::uint64_t value = UpperBound(i);
+        return value < max_ ? value : max_;
+      }
+    }
+    return max_;
+  }
+
+private:
+  static const int kSubBucketBits = 7;
+  static const std::uint64_t kSubBucketCount = 1 << kSubBucketBits;  // 128
+  static const std::uint64_t kHalfCount = kSubBucketCount / 2;  // 64
+  static const std::size_t kBucketCount =
+      kSubBucketCount + (64 - kSubBucketBits) * kHalfCount;
+
+  static int HighestBit(std::uint64_t value) {
+    int bit = 0;
+    while (value >>= 1) {
+      ++bit;
+    }
+    return bit;
+  }
+
+  // Values below 128 have their own bucket. Above that, a value is
+  // identified by its highest 7 bits and the number of bits shifted out.
+  static std::size_t Index(std::uint64_t value) {
+    if (value < kSubBucketCount) {
+      return static_cast<std::size_t>(value);
+    }
+    int shift = HighestBit(value) - kSubBucketBits + 1;
+    return static_cast<std::size_t>(kSubBucketCount + (shift - 1) * kHalfCount +
+                                    ((value >> shift) - kHalfCount));
+  }
+
+  // The highest value that falls into bucket |index|.
+  static std::uint64_t UpperBound(std::size_t index) {
+    if (index < kSubBucketCount) {
+      return index;
+    }
+    std::size_t shift = (index - kSubBucketCount) / kHalfCount + 1;
+    std::uint64_t top = (index - kSubBucketCount) % kHalfCount + kHalfCount;
+    return ((top + 1) << shift) - 1;
+  }
+
+  std::vector<std::uint64_t> counts_;
+  std::uint64_t total_;
+  std::uint64_t max_;
+};
+
+struct Item {
+  Clock::time_point due;
+  std::vector<char> payload;
+  bool end;  // Indicates end of buffer.
+};
+
+// BoundedBuffer (see bounded_buffer.cpp) that tells the producer how long
+// it was blocked on a full buffer.
+template <typename T>
+class BoundedBuffer {
+public:
+  BoundedBuffer(const BoundedBuffer& rhs) = delete;
+  BoundedBuffer& operator=(const BoundedBuffer& rhs) = delete;
+
+  BoundedBuffer(std::size_t size)
+      : begin_(0), end_(0), buffered_(0), circular_buffer_(size) {
+  }
+
+  // Return the time blocked.
+  Clock::duration Produce(T t) {
+    Clock::duration blocked = Clock::duration::zero();
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      if (buffered_ == circular_buffer_.size()) {
+        Clock::time_point start = Clock::now();
+        not_full_cv_.wait(lock, [this] { return buffered_ < circular_buffer_.size(); });
+        blocked = Clock::now() - start;
+      }
+
+      circular_buffer_[end_] = std::move(t);
+      end_ = (end_ + 1) % circular_buffer_.size();
+
+      ++buffered_;
+    }
+
+    not_empty_cv_.notify_one();
+    return blocked;
+  }
+
+  T Consume() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_cv_.wait(lock, [this] { return buffered_ > 0; });
+
+    T t = std::move(circular_buffer_[begin_]);
+    begin_ = (begin_ + 1) % circular_buffer_.size();
+
+    --buffered_;
+
+    lock.unlock();
+    not_full_cv_.notify_one();
+    return t;
+  }
+
+private:
+  std::size_t begin_;
+  std::size_t end_;
+  std::size_t buffered_;
+  std::vector<T> circular_buffer_;
+  std::condition_variable not_full_cv_;
+  std::condition_variable not_empty_cv_;
+  std::mutex mutex_;
+};
+
+struct ProducerResult {
+  std::uint64_t produced = 0;
+  Clock::duration blocked = Clock::duration::zero();
+};
+
+struct ConsumerResult {
+  Histogram latency;
+  std::uint64_t checksum = 0;
+};
+
+// |index| is in [0, options.producers).
+void Producer(const Options& options, int index, BoundedBuffer<Item>& buffer,
+              Clock::time_point start, Clock::time_point stop,
+              ProducerResult* result) {
+  // Open-loop: the interval between two items of this producer.
+  Clock::duration interval = Clock::duration::zero();
+  if (options.rate > 0) {
+    interval = std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(options.producers / options.rate));
+  }
+
+  // Interleave the producers: producer k is offset by k / P of an interval,
+  // so together they emit one item every 1 / rate, not P at once.
+  Clock::time_point first = start + interval * index / options.producers;
+
+  for (std::uint64_t i = 0;; ++i) {
+    Item item;
+    if (options.rate > 0) {
+      item.due = first + interval * i;
+      if (item.due >= stop) {
+        break;
+      }
+      std::this_thread::sleep_until(item.due);
+    } else {
+      item.due = Clock::now();
+      if (item.due >= stop) {
+        break;
+      }
+    }
+
+    item.payload.assign(options.payload, static_cast<char>(i));
+    item.end = false;
+
+    result->blocked += buffer.Produce(std::move(item));
+    ++result->produced;
+  }
+}
+
+void Consumer(BoundedBuffer<Item>& buffer, ConsumerResult* result) {
+  while (true) {
+    Item item = buffer.Consume();
+    if (item.end) {
+      break;
+    }
+
+    Clock::time_point now = Clock::now();
+    if (!item.payload.empty()) {
+      result->checksum += static_cast<unsigned char>(item.payload[0]);
+    }
+
+    std::int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+        now - item.due).count();
+    result->latency.Record(ns > 0 ? static_cast<std::uint64_t>(ns) : 0);
+  }
+}
+
+bool ParseOption(const char* arg, const char* name, double* value) {
+  std::size_t len = std::strlen(name);
+  if (std::strncmp(arg, name, len) != 0 || arg[len] != '=') {
+    return false;
+  }
+
+  char* end = nullptr;
+  *value = std::strtod(arg + len + 1, &end);
+  return end != arg + len + 1 && *end == '\0';
+}
+
+bool ParseOptions(int argc, char* argv[], Options* options) {
+  for (int i = 1; i < argc; ++i) {
+    double value = 0;
+    if (ParseOption(argv[i], "--producers", &value) && value >= 1) {
+      options->producers = static_cast<int>(value);
+    } else if (ParseOption(argv[i], "--consumers", &value) && value >= 1) {
+      options->consumers = static_cast<int>(value);
+    } else if (ParseOption(argv[i], "--capacity", &value) && value >= 1) {
+      options->capacity = static_cast<std::size_t>(value);
+    } else if (ParseOption(argv[i], "--payload", &value) && value >= 0) {
+      options->payload = static_cast<std::size_t>(value);
+    } else if (ParseOption(argv[i], "--rate", &value) && value >= 0) {
+      options->rate = value;
+    } else if (ParseOption(argv[i], "--duration", &value) && value > 0) {
+      options->duration = value;
+    } else {
+      std::cerr << "Invalid option: " << argv[i] << std::endl;
+      return false;
+    }
+  }
+  return true;
+}
+
+void PrintJson(const Options& options, double seconds,
+               const std::vector<ProducerResult>& producer_results,
+               const Histogram& latency) {
+  std::uint64_t produced = 0;
+  double blocked = 0;
+  for (const ProducerResult& result : producer_results) {
+    produced += result.produced;
+    blocked += std::chrono::duration<double>(result.blocked).count();
+  }
+
+  std::cout << "{\n"
+            << "  \"config\": {\n"
+            << "    \"producers\": " << options.producers << ",\n"
+            << "    \"consumers\": " << options.consumers << ",\n"
+            << "    \"capacity\": " << options.capacity << ",\n"
+            << "    \"payload_bytes\": " << options.payload << ",\n"
+            << "    \"target_rate\": " << options.rate << ",\n"
+            << "    \"duration_s\": " << options.duration << "\n"
+            << "  },\n"
+            << "  \"elapsed_s\": " << seconds << ",\n"
+            << "  \"items\": " << latency.total() << ",\n"
+            << "  \"throughput\": " << latency.total() / seconds << ",\n"
+            << "  \"latency_ns\": {\n"
+            << "    \"p50\": " << latency.Percentile(50) << ",\n"
+            << "    \"p90\": " << latency.Percentile(90) << ",\n"
+            << "    \"p99\": " << latency.Percentile(99) << ",\n"
+            << "    \"p99.9\": " << latency.Percentile(99.9) << ",\n"
+            << "    \"p99.99\": " << latency.Percentile(99.99) << ",\n"
+            << "    \"max\": " << latency.max() << "\n"
+            << "  },\n"
+            << "  \"producer_blocked_s\": " << blocked << ",\n"
+            << "  \"producer_blocked_ratio\": "
+            << blocked / (seconds * options.producers) << "\n"
+            << "}" << std::endl;
+}
+
+int main(int argc, char* argv[]) {
+  Options options;
+  if (!ParseOptions(argc, argv, &options)) {
+    return 1;
+  }
+
+  BoundedBuffer<Item> buffer(options.capacity);
+
+  std::vector<ProducerResult> producer_results(options.producers);
+  std::vector<ConsumerResult> consumer_results(options.consumers);
+
+  std::vector<std::thread> consumers;
+  for (int i = 0; i < options.consumers; ++i) {
+    consumers.emplace_back(&Consumer, std::ref(buffer), &consumer_results[i]);
+  }
+
+  Clock::time_point start = Clock::now();
+  Clock::time_point stop =
+      start + std::chrono::duration_cast<Clock::duration>(
+                  std::chrono::duration<double>(options.duration));
+
+  std::vector<std::thread> producers;
+  for (int i = 0; i < options.producers; ++i) {
+    producers.emplace_back(&Producer, std::cref(options), i, std::ref(buffer),
+                           start, stop, &producer_results[i]);
+  }
+
+  for (auto& t : producers) {
+    t.join();
+  }
+
+  // One end mark per consumer.
+  for (int i = 0; i < options.consumers; ++i) {
+    Item item;
+    item.end = true;
+    buffer.Produce(std::move(item));
+  }
+
+  for (auto& t : consumers) {
+    t.join();
+  }
+
+  double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+  // Per-consumer histograms are merged at the end, so recording doesn't
+  // contend.
+  Histogram latency;
+  for (const ConsumerResult& result : consumer_results) {
+    latency.Merge(result.latency);
+  }
+
+  PrintJson(options, seconds, producer_results, latency);
+  return 0;
+}
+
+// Output example (load_generator --rate=100000 --duration=2, 1 core):
+// {
+//   "config": {
+//     "producers": 1,
+//     "consumers": 3,
+//     "capacity": 2,
+//     "payload_bytes": 64,
+//     "target_rate": 100000,
+//     "duration_s": 2
+//   },
+//   "elapsed_s": 2.00017,
+//   "items": 200000,
+//   "throughput": 99991.7,
+//   "latency_ns": {
+//     "p50": 53759,
+//     "p90": 14155775,
+//     "p99": 20185087,
+//     "p99.9": 21495807,
+//     "p99.99": 21757951,
+//     "max": 21824335
+//   },
+//   "producer_blocked_s": 0.236817,
+//   "producer_blocked_ratio": 0.118399
+// }
@@ -0,0 +1,381 @@
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+// Pass large payloads through a bounded buffer without copying them and
+// without calling malloc/free per item.
+
+// A MessagePool hands out fixed-size blocks carved from big slabs. Each
+// thread keeps a small cache of free blocks, so most Allocate() and Free()
+// calls touch no lock at all. When a cache runs dry it takes a whole batch
+// from the pool; when it grows too big (a consumer keeps freeing blocks that
+// a producer allocated) it gives a whole batch back. Either way the pool's
+// mutex is taken once per batch, not once per block.
+
+// Only a Message (a pointer to the block) travels through the queue. The
+// consumer reads the payload in place, in the memory the producer wrote.
+
+// See:
+// https://en.wikipedia.org/wiki/Slab_allocation
+// http://jemalloc.net/jemalloc.3.html (tcache)
+
+class MessagePool;
+
+// Block header, followed by the payload. 64 bytes so that the payload starts
+// on its own cache line.
+struct alignas(64) Block {
+  MessagePool* pool;
+  Block* next;
+  std::size_t size;  // Bytes used of the payload.
+};
+
+class MessagePool {
+public:
+  MessagePool(const MessagePool& rhs) = delete;
+  MessagePool& operator=(const MessagePool& rhs) = delete;
+
+  // NOTE: The pool must outlive every thread that uses it, because the
+  // thread caches are flushed back to it at thread exit.
+  MessagePool(std::size_t block_size, std::size_t blocks_per_slab,
+              std::size_t batch_size = 32)
+      : block_size_(block_size), blocks_per_slab_(blocks_per_slab),
+        batch_size_(batch_size), free_list_(nullptr), free_count_(0),
+        slab_count_(0), batch_count_(0) {
+  }
+
+  std::size_t block_size() const {
+    return block_size_;
+  }
+
+  // Number of slabs allocated from the system so far.
+  std::size_t slab_count() const {
+    return slab_count_;
+  }
+
+  // Number of times the pool's mutex was taken to move a batch.
+  std::size_t batch_count() const {
+    return batch_count_;
+  }
+
+  Block* Allocate() {
+    ThreadCache& cache = GetThreadCache();
+    if (cache.blocks.empty()) {
+      TakeBatch(&cache.blocks);
+    }
+
+    Block* block = cache.blocks.back();
+    cache.blocks.pop_back();
+    block->size = 0;
+    return block;
+  }
+
+  // Free a block to the cache of the calling thread, which is often not the
+  // thread that allocated it.
+  void Free(Block* block) {
+    ThreadCache& cache = GetThreadCache();
+    cache.blocks.push_back(block);
+
+    if (cache.blocks.size() >= 2 * batch_size_) {
+      GiveBatch(&cache.blocks, batch_size_);
+    }
+  }
+
+private:
+  struct ThreadCache {
+    std::vector<Block*> blocks;
+  };
+
+  // All the caches of a thread, one per pool. Flushed at thread exit.
+  class ThreadCaches {
+  public:
+    ~ThreadCaches() {
+      for (auto& pair : caches_) {
+        pair.first->GiveBatch(&pair.second.blocks, pair.second.blocks.size());
+      }
+    }
+
+    ThreadCache& Get(MessagePool* pool) {
+      return caches_[pool];
+    }
+
+  private:
+    std::unordered_map<MessagePool*, ThreadCache> caches_;
+  };
+
+  ThreadCache& GetThreadCache() {
+    static thread_local ThreadCaches caches;
+    return caches.Get(this);
+  }
+
+  void TakeBatch(std::vector<Block*>* blocks) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++batch_count_;
+
+    if (free_count_ == 0) {
+      AddSlab();
+    }
+
+    for (std::size_t i = 0; i < batch_size_ && free_list_ != nullptr; ++i) {
+      Block* block = free_list_;
+      free_list_ = block->next;
+      --free_count_;
+      blocks->push_back(block);
+    }
+  }
+
+  // Give the last |n| blocks of |blocks| back to the pool.
+  void GiveBatch(std::vector<Block*>* blocks, std::size_t n) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ++batch_count_;
+
+    for (std::size_t i = 0; i < n; ++i) {
+      Block* block = blocks->back();
+      blocks->pop_back();
+      block->next = free_list_;
+      free_list_ = block;
+      ++free_count_;
+    }
+  }
+
+  // Called with the mutex locked.
+  void AddSlab() {
+    std::size_t stride = sizeof(Block) + RoundUp(block_size_, sizeof(Block));
+
+    // Over-allocate a little so the first block can be aligned.
+    std::unique_ptr<char[]> slab(
+        new char[stride * blocks_per_slab_ + alignof(Block)]);
+
+    char* p = slab.get();
+    p += (alignof(Block) - reinterpret_cast<std::uintptr_t>(p) %
+                               alignof(Block)) % alignof(Block);
+
+    for (std::size_t i = 0; i < blocks_per_slab_; ++i) {
+      Block* block = new (p + i * stride) Block;
+      block->pool = this;
+      block->next = free_list_;
+      free_list_ = block;
+    }
+
+    free_count_ += blocks_per_slab_;
+    slabs_.push_back(std::move(slab));
+    ++slab_count_;
+  }
+
+  static std::size_t RoundUp(std::size_t n, std::size_t align) {
+    return (n + align - 1) / align * align;
+  }
+
+  const std::size_t block_size_;
+  const std::size_t blocks_per_slab_;
+  const std::size_t batch_size_;
+
+  std::mutex mutex_;
+  Block* free_list_;
+  std::size_t free_count_;
+  std::vector<std::unique_ptr<char[]>> slabs_;
+
+  std::atomic<std::size_t> slab_count_;
+  std::atomic<std::size_t> batch_count_;
+};
+
+// A move-only handle to a pooled block. This is what goes through the queue.
+class Message {
+public:
+  Message() : block_(nullptr) {
+  }
+
+  explicit Message(MessagePool& pool) : block_(pool.Allocate()) {
+  }
+
+  Message(const Message& rhs) = delete;
+  Message& operator=(const Message& rhs) = delete;
+
+  Message(Message&& rhs) : block_(rhs.block_) {
+    rhs.block_ = nullptr;
+  }
+
+  Message& operator=(Message&& rhs) {
+    if (this != &rhs) {
+      Reset();
+      block_ = rhs.block_;
+      rhs.block_ = nullptr;
+    }
+    return *this;
+  }
+
+  ~Message() {
+    Reset();
+  }
+
+  explicit operator bool() const {
+    return block_ != nullptr;
+  }
+
+  char* data() {
+    return reinterpret_cast<char*>(block_ + 1);
+  }
+
+  const char* data() const {
+    return reinterpret_cast<const char*>(block_ + 1);
+  }
+
+  std::size_t size() const {
+    return block_->size;
+  }
+
+  void set_size(std::size_t size) {
+    block_->size = size;
+  }
+
+  std::size_t capacity() const {
+    return block_->pool->block_size();
+  }
+
+  // Return the block to its pool.
+  void Reset() {
+    if (block_ != nullptr) {
+      block_->pool->Free(block_);
+      block_ = nullptr;
+    }
+  }
+
+private:
+  Block* block_;
+};
+
+// BoundedBuffer (see bounded_buffer.cpp) for move-only items.
+template <typename T>
+class BoundedBuffer {
+public:
+  BoundedBuffer(const BoundedBuffer& rhs) = delete;
+  BoundedBuffer& operator=(const BoundedBuffer& rhs) = delete;
+
+  BoundedBuffer(std::size_t size)
+      : begin_(0), end_(0), buffered_(0), circular_buffer_(size) {
+  }
+
+  void Produce(T t) {
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      not_full_cv_.wait(lock, [this] { return buffered_ < circular_buffer_.size(); });
+
+      circular_buffer_[end_] = std::move(t);
+      end_ = (end_ + 1) % circular_buffer_.size();
+
+      ++buffered_;
+    }
+
+    not_empty_cv_.notify_one();
+  }
+
+  T Consume() {
+    std::unique_lock<std::mutex> lock(mutex_);
+    not_empty_cv_.wait(lock, [this] { return buffered_ > 0; });
+
+    T t = std::move(circular_buffer_[begin_]);
+    begin_ = (begin_ + 1) % circular_buffer_.size();
+
+    --buffered_;
+
+    lock.unlock();
+    not_full_cv_.notify_one();
+    return t;
+  }
+
+private:
+  std::size_t begin_;
+  std::size_t end_;
+  std::size_t buffered_;
+  std::vector<T> circular_buffer_;
+  std::condition_variable not_full_cv_;
+  std::condition_variable not_empty_cv_;
+  std::mutex mutex_;
+};
+
+const std::size_t kPayloadSize = 8 * 1024;
+
+MessagePool g_pool(kPayloadSize, 64);
+BoundedBuffer<Message> g_buffer(16);
+std::atomic<std::uint64_t> g_checksum(0);
+
+void Producer(int count) {
+  for (int n = 0; n < count; ++n) {
+    Message msg(g_pool);
+
+    // Write the payload in place. It is never copied after this.
+    std::memset(msg.data(), n & 0xFF, msg.capacity());
+    msg.set_size(msg.capacity());
+
+    g_buffer.Produce(std::move(msg));
+  }
+
+  g_buffer.Produce(Message());  // An empty message indicates end of buffer.
+}
+
+void Consumer() {
+  std::uint64_t checksum = 0;
+  while (true) {
+    Message msg = g_buffer.Consume();
+    if (!msg) {
+      break;
+    }
+
+    for (std::size_t i = 0; i < msg.size(); i += 1024) {
+      checksum += static_cast<unsigned char>(msg.data()[i]);
+    }
+    // The block goes back to this thread's cache here.
+  }
+
+  g_checksum += checksum;
+  g_buffer.Produce(Message());  // For stopping next consumer.
+}
+
+void Run(int count) {
+  std::vector<std::thread> threads;
+
+  threads.push_back(std::thread(&Producer, count));
+  threads.push_back(std::thread(&Consumer));
+  threads.push_back(std::thread(&Consumer));
+  threads.push_back(std::thread(&Consumer));
+
+  for (auto& t : threads) {
+    t.join();
+  }
+
+  // Take out the end mark left by the last consumer.
+  g_buffer.Consume();
+}
+
+int main() {
+  // Warm up: the pool grows to the number of blocks in flight.
+  Run(10000);
+  std::size_t slabs = g_pool.slab_count();
+  std::size_t batches = g_pool.batch_count();
+
+  // Steady state: the same blocks are reused, no new slab is needed.
+  g_checksum = 0;
+  Run(100000);
+
+  std::cout << "slabs after warm-up: " << slabs << std::endl;
+  std::cout << "slabs after 100000 messages: " << g_pool.slab_count()
+            << std::endl;
+  std::cout << "pool lock acquisitions per message: "
+            << (g_pool.batch_count() - batches) / 100000.0 << std::endl;
+  std::cout << "checksum: " << g_checksum << std::endl;
+
+  return 0;
+}
+
+// Output example:
+// slabs after warm-up: 4
+// slabs after 100000 messages: 4
+// pool lock acquisitions per message: 0.0624
+// checksum: 101938560
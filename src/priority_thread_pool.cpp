@@ -0,0 +1,289 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <future>
+#include <iostream>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+
+#include "boost/asio.hpp"
+
+// A thread pool with priority lanes (see also
+// doc/CppConcurrency04.ThreadPoolBasedOnAsio.md).
+
+// io_context runs handlers roughly in FIFO order, so a burst of background
+// work delays an urgent request by the whole backlog. Here each Enqueue()
+// puts the task into a lane of its own, and only posts a "run the most
+// urgent task" handler to io_context. This is the pattern of Asio's
+// prioritised handlers example.
+
+// Scheduling is earliest deadline first (EDF). A task's deadline is either
+// given explicitly (EnqueueBefore) or its enqueue time plus the latency
+// budget of its lane. Within a lane the deadlines are increasing, so a
+// worker only compares the fronts of the lanes, which is cheap. And a low
+// priority task is not starved: once it has waited for its budget, its
+// deadline is earlier than that of any newly enqueued high priority task
+// (aging comes for free).
+
+// See:
+// https://think-async.com/Asio/asio-1.18.0/src/examples/cpp11/invocation/prioritised_handlers.cpp
+// https://en.wikipedia.org/wiki/Earliest_deadline_first_scheduling
+
+typedef std::chrono::steady_clock Clock;
+
+enum class Priority {
+  kHigh = 0,
+  kNormal = 1,
+  kLow = 2,
+};
+
+class PriorityThreadPool {
+public:
+  // Queue-time statistics of a lane.
+  struct LaneStats {
+    std::uint64_t count = 0;
+    Clock::duration total_wait = Clock::duration::zero();
+    Clock::duration max_wait = Clock::duration::zero();
+  };
+
+  PriorityThreadPool(const PriorityThreadPool& rhs) = delete;
+  PriorityThreadPool& operator=(const PriorityThreadPool& rhs) = delete;
+
+  explicit PriorityThreadPool(std::size_t size)
+      : work_guard_(boost::asio::make_work_guard(io_context_)),
+        stats_(kLaneCount) {
+    budgets_[static_cast<int>(Priority::kHigh)] = std::chrono::milliseconds(1);
+    budgets_[static_cast<int>(Priority::kNormal)] =
+        std::chrono::milliseconds(100);
+    budgets_[static_cast<int>(Priority::kLow)] = std::chrono::seconds(1);
+
+    workers_.reserve(size);
+    for (std::size_t i = 0; i < size; ++i) {
+      workers_.emplace_back(&boost::asio::io_context::run, &io_context_);
+    }
+  }
+
+  ~PriorityThreadPool() {
+    // Let the queued work items finish.
+    work_guard_.reset();
+
+    for (auto& w : workers_) {
+      w.join();
+    }
+  }
+
+  // The latency budget of a lane decides how long its tasks can wait before
+  // they are run ahead of the lanes above. A new budget applies to the tasks
+  // enqueued from now on. A lower budget never gives them a deadline before
+  // the tasks already in the lane (see Enqueue()), so it takes full effect
+  // once the lane has drained.
+  void set_budget(Priority priority, Clock::duration budget) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    budgets_[static_cast<int>(priority)] = budget;
+  }
+
+  // Add new work item to the pool.
+  template <class F>
+  void Enqueue(F f, Priority priority = Priority::kNormal) {
+    int lane = static_cast<int>(priority);
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      Clock::time_point now = Clock::now();
+      Clock::time_point deadline = now + budgets_[lane];
+      // Keep the deadlines in a lane increasing, even after set_budget()
+      // lowered the budget: RunOne() only looks at the front.
+      if (!lanes_[lane].empty()) {
+        deadline = std::max(deadline, lanes_[lane].back().deadline);
+      }
+      lanes_[lane].push_back(Task{ f, now, deadline, lane });
+    }
+    boost::asio::post(io_context_, [this] { RunOne(); });
+  }
+
+  // Add new work item with an explicit deadline.
+  template <class F>
+  void EnqueueBefore(F f, Clock::time_point deadline) {
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      deadline_lane_.push(Task{ f, Clock::now(), deadline, kDeadlineLane });
+    }
+    boost::asio::post(io_context_, [this] { RunOne(); });
+  }
+
+  LaneStats stats(Priority priority) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[static_cast<int>(priority)];
+  }
+
+  LaneStats deadline_stats() {
+    std::lock_guard<std::mutex> lock(mutex_);
+    return stats_[kDeadlineLane];
+  }
+
+private:
+  static const int kPriorityCount = 3;
+  static const int kDeadlineLane = kPriorityCount;
+  static const int kLaneCount = kPriorityCount + 1;
+
+  struct Task {
+    std::function<void()> func;
+    Clock::time_point enqueue_time;
+    Clock::time_point deadline;
+    int lane;
+  };
+
+  struct LaterDeadline {
+    bool operator()(const Task& lhs, const Task& rhs) const {
+      return lhs.deadline > rhs.deadline;
+    }
+  };
+
+  // Each Enqueue() posts exactly one RunOne(), so there is always a task.
+  void RunOne() {
+    Task task;
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+
+      // The lane with the earliest deadline at its front. The high priority
+      // lane is checked first, so on a tie it wins.
+      int best = -1;
+      for (int lane = 0; lane < kPriorityCount; ++lane) {
+        if (!lanes_[lane].empty() &&
+            (best == -1 ||
+             lanes_[lane].front().deadline < lanes_[best].front().deadline)) {
+          best = lane;
+        }
+      }
+
+      if (!deadline_lane_.empty() &&
+          (best == -1 ||
+           deadline_lane_.top().deadline < lanes_[best].front().deadline)) {
+        task = deadline_lane_.top();
+        deadline_lane_.pop();
+      } else {
+        task = std::move(lanes_[best].front());
+        lanes_[best].pop_front();
+      }
+
+      Clock::duration wait = Clock::now() - task.enqueue_time;
+      LaneStats& stats = stats_[task.lane];
+      ++stats.count;
+      stats.total_wait += wait;
+      stats.max_wait = std::max(stats.max_wait, wait);
+    }
+
+    task.func();
+  }
+
+  std::vector<std::thread> workers_;
+  boost::asio::io_context io_context_;
+
+  typedef boost::asio::io_context::executor_type ExecutorType;
+  boost::asio::executor_work_guard<ExecutorType> work_guard_;
+
+  std::mutex mutex_;
+  Clock::duration budgets_[kPriorityCount];
+  std::deque<Task> lanes_[kPriorityCount];
+  std::priority_queue<Task, std::vector<Task>, LaterDeadline> deadline_lane_;
+  std::vector<LaneStats> stats_;
+};
+
+// Burn some CPU to simulate work.
+void Spin(std::chrono::microseconds duration) {
+  Clock::time_point end = Clock::now() + duration;
+  while (Clock::now() < end) {
+  }
+}
+
+double Percentile(std::vector<double> values, double percentile) {
+  if (values.empty()) {
+    return 0;
+  }
+  std::sort(values.begin(), values.end());
+  std::size_t index = static_cast<std::size_t>(percentile / 100 *
+                                               (values.size() - 1));
+  return values[index];
+}
+
+// Saturate the pool with background work, then measure how long a stream
+// of urgent tasks waits in the queue.
+void Run(Priority urgent_priority) {
+  std::vector<double> waits;  // In microseconds.
+  std::mutex waits_mutex;
+
+  const int kUrgentCount = 100;
+  const std::size_t kWorkers = 4;
+
+  // 3000 tasks of 200us per worker that has a core: about 0.6s.
+  std::size_t cores = std::max(1u, std::thread::hardware_concurrency());
+  std::size_t background_count = 3000 * std::min(kWorkers, cores);
+
+  std::atomic<std::size_t> remaining(background_count + kUrgentCount);
+  std::promise<void> done;
+
+  {
+    PriorityThreadPool pool(kWorkers);
+
+    for (std::size_t i = 0; i < background_count; ++i) {
+      pool.Enqueue([&] {
+        Spin(std::chrono::microseconds(200));
+        if (--remaining == 0) {
+          done.set_value();
+        }
+      }, Priority::kLow);
+    }
+
+    for (int i = 0; i < kUrgentCount; ++i) {
+      Clock::time_point enqueue_time = Clock::now();
+      pool.Enqueue([&, enqueue_time] {
+        double wait = std::chrono::duration<double, std::micro>(
+            Clock::now() - enqueue_time).count();
+        {
+          std::lock_guard<std::mutex> lock(waits_mutex);
+          waits.push_back(wait);
+        }
+        if (--remaining == 0) {
+          done.set_value();
+        }
+      }, urgent_priority);
+
+      std::this_thread::sleep_for(std::chrono::milliseconds(2));
+    }
+
+    done.get_future().wait();
+
+    PriorityThreadPool::LaneStats low = pool.stats(Priority::kLow);
+    std::cout << "  low lane: " << low.count << " tasks, max wait="
+              << std::chrono::duration_cast<std::chrono::milliseconds>(
+                     low.max_wait).count()
+              << "ms" << std::endl;
+  }
+
+  std::cout << "  urgent tasks: p50=" << Percentile(waits, 50)
+            << "us, p99=" << Percentile(waits, 99) << "us" << std::endl;
+}
+
+int main() {
+  std::cout << "Urgent tasks in the same lane as the background work:"
+            << std::endl;
+  Run(Priority::kLow);
+
+  std::cout << "Urgent tasks in the high priority lane:" << std::endl;
+  Run(Priority::kHigh);
+
+  return 0;
+}
+
+// Output example (1 core):
+// Urgent tasks in the same lane as the background work:
+//   low lane: 3100 tasks, max wait=604ms
+//   urgent tasks: p50=472886us, p99=590610us
+// Urgent tasks in the high priority lane:
+//   low lane: 3000 tasks, max wait=576ms
+//   urgent tasks: p50=12.903us, p99=208.03us